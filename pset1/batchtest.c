@@ -0,0 +1,53 @@
+#include "m61.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+// batchtest: throughput of m61_malloc_batch/m61_free_batch against
+// loops of malloc/free.
+//
+// Usage: batchtest [SIZE [BATCH [ROUNDS]]]
+// Each round allocates BATCH blocks of SIZE bytes and then frees them all,
+// first one at a time and then with the batch APIs.
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv) {
+    size_t sz = 48;
+    size_t batch = 4096;
+    unsigned long rounds = 200;
+    if (argc >= 2)
+	sz = strtoul(argv[1], 0, 0);
+    if (argc >= 3)
+	batch = strtoul(argv[2], 0, 0);
+    if (argc >= 4)
+	rounds = strtoul(argv[3], 0, 0);
+
+    void **ptrs = (void **) calloc(batch, sizeof(void *));
+
+    double start = now();
+    for (unsigned long r = 0; r < rounds; ++r) {
+	for (size_t i = 0; i < batch; ++i)
+	    ptrs[i] = malloc(sz);
+	for (size_t i = 0; i < batch; ++i)
+	    free(ptrs[i]);
+    }
+    double loop_time = now() - start;
+
+    start = now();
+    for (unsigned long r = 0; r < rounds; ++r) {
+	size_t n = m61_malloc_batch(sz, batch, ptrs);
+	m61_free_batch(ptrs, n);
+    }
+    double batch_time = now() - start;
+
+    free(ptrs);
+    double nblocks = (double) batch * rounds;
+    printf("size %zu batch %zu: loop %.1f ns/block, batch %.1f ns/block (%.2fx)\n",
+	   sz, batch, loop_time * 1e9 / nblocks, batch_time * 1e9 / nblocks,
+	   batch_time > 0 ? loop_time / batch_time : 0.0);
+    m61_printstatistics();
+}
@@ -4,169 +4,415 @@
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "assert.h"
 
-unsigned long long mTotalAlloc_Count = 0;
-unsigned long long mTotalAlloc_Size = 0;
+//Build with -DM61_GLOBAL_LOCK=1 to serialize every call through one
+//mutex and free cross-thread blocks directly into the owner's arena.
+//This is the baseline that pctest compares the remote-free lists against.
+#ifndef M61_GLOBAL_LOCK
+#define M61_GLOBAL_LOCK 0
+#endif
 
-unsigned long long mActive_Count = 0;
-unsigned long long mActive_Size = 0;
+//Lookup table from memory header pointer to list node, shared by all
+//threads so a free can be validated without knowing the owner. Buckets
+//are guarded by a small set of striped mutexes.
+#define M61_HASHSIZE 65536
+#define M61_NLOCKS 64
+#define M61_BATCHCHUNK 256	// blocks per lock pass in the batch APIs
+#define M61_RETIRED 1024	// nodes of released blocks kept per arena
+static listNode* nodeTable[M61_HASHSIZE];
+static pthread_mutex_t nodeLocks[M61_NLOCKS] = {
+  [0 ... M61_NLOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
-unsigned long long mFail_Count = 0;
-unsigned long long mFail_Size = 0;
+static m61_arena* arenaList = NULL;        //registry of all arenas.
+static __thread m61_arena* myArena = NULL; //arena of the calling thread.
+__thread m61_arena* m61_fastArena = NULL;
+static pthread_key_t arenaKey;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+//Allocation limit and failure injection. The M61_FAIL environment
+//variable holds comma-separated settings, for example
+//    M61_FAIL="limit=1048576,rate=0.001,seed=7,site=parse.c:120,site=lex.c"
+//limit: fail any allocation that would push active bytes past this.
+//rate:  fail this fraction of allocations at random (seeded by `seed`).
+//site:  fail every allocation from this file, or this file and line.
+//m61_setlimit() changes the limit at run time. While nothing is
+//configured here or in M61_GUARD below, m61_debugArmed is 0 and the
+//only cost is testing it.
+#define M61_MAXSITES 16
+typedef struct failSite
+{
+  char file[128];
+  int line;                     //0 matches any line.
+}failSite;
+
+int m61_debugArmed = 0;
+static size_t limitBytes = 0;           //0 means no limit.
+static size_t limitUsed = 0;            //active bytes charged to the limit.
+static uint64_t failThreshold = 0;      //fail if random value < this.
+static uint64_t failSeed = 0;
+static unsigned failThreadCount = 0;
+static __thread uint64_t failRandState = 0;
+static failSite failSites[M61_MAXSITES];
+static int nFailSites = 0;
+
+//Guard-page mode, configured from the M61_GUARD environment variable:
+//    M61_GUARD="min=65536,sample=1000"
+//min:    allocations of at least this many bytes get a guard page.
+//sample: so does every Nth allocation of any size.
+//A guarded block is its own mapping, placed so the payload ends at a
+//PROT_NONE page; the few alignment bytes in between are filled with
+//M61_SLACKBYTE and checked at free. An overflow faults on the spot and
+//the SIGSEGV handler names the block and its allocation site. Freed
+//mappings are kept in a small cache and reused without system calls.
+#define M61_MAXGUARDS 4096
+#define M61_GUARDCACHE 64
+#define M61_SLACKBYTE 0xA5
+typedef struct guardEntry
+{
+  char* guardPage;              //start of the PROT_NONE page.
+  listNode* node;               //block whose payload ends at guardPage.
+}guardEntry;
+
+typedef struct guardMapping
+{
+  char* base;
+  size_t mapSize;               //bytes mapped, guard page included.
+}guardMapping;
+
+static size_t guardMin = 0;             //0 means no size-based guards.
+static unsigned guardSample = 0;        //0 means no sampled guards.
+static __thread unsigned guardTick = 0;
+static size_t pageSize = 4096;
+static guardEntry guardTable[M61_MAXGUARDS];
+static guardMapping guardCache[M61_GUARDCACHE];
+static int nGuardCache = 0;
+static pthread_mutex_t guardLock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction oldSegvAction;
+
+#if M61_GLOBAL_LOCK
+static pthread_mutex_t m61_lock = PTHREAD_MUTEX_INITIALIZER;
+#define M61_LOCK()	pthread_mutex_lock(&m61_lock)
+#define M61_UNLOCK()	pthread_mutex_unlock(&m61_lock)
+#else
+#define M61_LOCK()	((void) 0)
+#define M61_UNLOCK()	((void) 0)
+#endif
+
+/*take_node()
+Purpose: reuse a recycled list node, if the arena has one.
+Arguments:
+    arena: the calling thread's arena.
+Return:
+    a zeroed node, or NULL.
+*/
+static listNode* take_node(m61_arena* arena)
+{
+  listNode* node = arena->spareNodes;
+  if(node != NULL)
+  {
+    arena->spareNodes = node->next;
+    memset(node, 0, sizeof(listNode));
+  }
+  return node;
+}
 
-listNode* head = NULL;  //pointer to the head of List.
 
 /*create_node()
 Purpose: to create a list node.
 Arguments:
+    arena: the calling thread's arena.
     ptr: pointer to memory header.
 Return:
     A list node.
 */
-listNode* create_node(void* ptr)
+listNode* create_node(m61_arena* arena, void* ptr)
 {
-  listNode* newNode = NULL;
-  newNode = (listNode*)malloc(sizeof(listNode));
+  listNode* newNode = take_node(arena);
+  if(newNode == NULL)
+    newNode = (listNode*)malloc(sizeof(listNode));
   newNode->memPtr = ptr;
   newNode->IsFree = false;
   newNode->prev = NULL;
   newNode->next = NULL;
+  newNode->hashNext = NULL;
+  newNode->mapSize = 0;
+  newNode->guardSlot = 0;
 
   return newNode;
 }
 
 
+/*link_node()
+Purpose: insert_node() for a caller that already holds the list lock.
+*/
+static void link_node(m61_arena* arena, listNode* current)
+{
+  current->next = arena->head;
+  current->prev = NULL;
+  if(arena->head != NULL)
+    arena->head->prev = current;
+  arena->head = current;
+}
+
+
 /*insert_node()
-Purpose: to insert a node in the list.
+Purpose: to insert a node in an arena's list. Only the owning thread
+changes the list, but the leak report and invalid-free check may walk it
+from another thread, so both sides hold the arena's list lock.
 Arguments:
+    arena: arena that owns the list.
     current: current pointer to the node to be inserted in list.
 Return:
 */
-void insert_node(listNode* current)
+void insert_node(m61_arena* arena, listNode* current)
 {
-  if(head == NULL)
-  {
-    head = current;
-  }
-  else
-  {
-    current->next = (void*)head;
-    current->prev = NULL;
-    head = current;
-  }
+  pthread_mutex_lock(&arena->listLock);
+  link_node(arena, current);
+  pthread_mutex_unlock(&arena->listLock);
 }
 
 
-/*contains_node()
-Purpose: to check if a node is in the list.
+/*node_bucket()
+Purpose: hash a memory header pointer to its lookup-table bucket.
 Arguments:
-    current: current pointer to the node.
+    ptr: memory header pointer.
 Return:
-    'true' or 'false'
+    bucket index.
 */
-bool contains_node(listNode* current)
+static inline size_t node_bucket(const void* ptr)
 {
-  listNode* temp = head;
-  while(temp != NULL)
+  uintptr_t addr = (uintptr_t) ptr >> 4;
+  return (size_t) ((addr * 0x9E3779B97F4A7C15ULL) >> 32) & (M61_HASHSIZE - 1);
+}
+
+
+/*hash_node()
+Purpose: to make a node findable by its memory header pointer. Older
+nodes for the same address describe blocks that were freed before the
+system allocator reused the address; they are dropped from the chain
+(they stay on their arena's list).
+Arguments:
+    current: node to add.
+Return:
+*/
+static void hash_node(listNode* current)
+{
+  size_t b = node_bucket(current->memPtr);
+  pthread_mutex_t* lock = &nodeLocks[b & (M61_NLOCKS - 1)];
+  pthread_mutex_lock(lock);
+  listNode** pprev = &nodeTable[b];
+  while(*pprev != NULL)
   {
-    if(temp == current)
-      return true;
+    if((*pprev)->memPtr == current->memPtr)
+      *pprev = (*pprev)->hashNext;
     else
-      temp = (listNode*)(temp->next);
+      pprev = &(*pprev)->hashNext;
   }
-  return false;
+  current->hashNext = nodeTable[b];
+  nodeTable[b] = current;
+  pthread_mutex_unlock(lock);
 }
 
 
-/*remove_node()
-Purpose: to remove a node from the list.
+/*find_node()
+Purpose: to check a node in the lookup table. Never dereferences
+`pLookUpPtr`, so wild pointers are safe to look up.
 Arguments:
-    current: current pointer to the node to be removed from list.
+    pLookUpPtr: input memory header pointer to check in list.
 Return:
+    the node pointer.
 */
-void remove_node(listNode* current)
+listNode* find_node(void* pLookUpPtr)
 {
-    if(contains_node(current))
-    {
-	listNode *tmp, *q;
-	if(head == current)
-	{
-	  tmp = head;
-	  head = head->next;
-	  //head->prev = NULL;
-	  free((void*)tmp);
-	  return;
-	}
-	q = head;
-	while(q->next->next != NULL)
-	{
-	    if(q->next == current)
-	    {
-		tmp = q->next;
-		q->next = tmp->next;
-		tmp->next->prev = q;
-		free((void*)tmp);
-		  return;
+    size_t b = node_bucket(pLookUpPtr);
+    pthread_mutex_t* lock = &nodeLocks[b & (M61_NLOCKS - 1)];
+    pthread_mutex_lock(lock);
+    listNode* temp = nodeTable[b];
+    while(temp != NULL && temp->memPtr != pLookUpPtr)
+      temp = temp->hashNext;
+    pthread_mutex_unlock(lock);
+    return temp;
+}
 
-	    }
-	    q = q->next;
 
-	}
-	if(q->next == current)
-	{
-	    tmp = q->next;
-	    free((void*)tmp);
-	    q->next = NULL;
-	    return;
-	}
-    }
+/*unhash_node()
+Purpose: remove a node from the lookup table, if it is still there
+(hash_node drops it once its address is reused).
+Arguments:
+    node: node to remove.
+Return:
+*/
+static void unhash_node(listNode* node)
+{
+  size_t b = node_bucket(node->memPtr);
+  pthread_mutex_t* lock = &nodeLocks[b & (M61_NLOCKS - 1)];
+  pthread_mutex_lock(lock);
+  listNode** pprev = &nodeTable[b];
+  while(*pprev != NULL && *pprev != node)
+    pprev = &(*pprev)->hashNext;
+  if(*pprev != NULL)
+    *pprev = node->hashNext;
+  pthread_mutex_unlock(lock);
 }
 
 
-/*count_node()
-Purpose: Count the nodes in list.
+/*retire_node()
+Purpose: take the node of a block that went back to the system off its
+arena's list. The node stays in the lookup table, so a double free is
+still reported, until M61_RETIRED later blocks have been retired; then
+it is unhashed and recycled by take_node(). The caller must own the
+arena.
 Arguments:
-    
+    arena: owner of the block.
+    node: the block's node.
 Return:
-integer count.
 */
-int count_node()
+static void retire_node(m61_arena* arena, listNode* node)
 {
-    listNode* temp = head; 
-    int cnt = 0;
-    while(temp != NULL)
+  pthread_mutex_lock(&arena->listLock);
+  if(node->prev != NULL)
+    node->prev->next = node->next;
+  else
+    arena->head = node->next;
+  if(node->next != NULL)
+    node->next->prev = node->prev;
+  pthread_mutex_unlock(&arena->listLock);
+
+  node->next = NULL;
+  if(arena->retiredTail != NULL)
+    arena->retiredTail->next = node;
+  else
+    arena->retiredHead = node;
+  arena->retiredTail = node;
+
+  if(++arena->nRetired > M61_RETIRED)
+  {
+    listNode* oldest = arena->retiredHead;
+    arena->retiredHead = oldest->next;
+    --arena->nRetired;
+    unhash_node(oldest);
+    oldest->next = arena->spareNodes;
+    arena->spareNodes = oldest;
+  }
+}
+
+
+/*order_by_lock()
+Purpose: order a batch of header pointers by lookup-table lock, so a
+batch takes each lock once instead of once per block.
+Arguments:
+    keys: memory header pointers (NULL entries are allowed).
+    n: number of keys.
+    buckets: output, lookup-table bucket of each key.
+    order: output, indexes into `keys` grouped by lock.
+Return:
+*/
+static void order_by_lock(void* const* keys, size_t n, size_t* buckets, size_t* order)
+{
+  size_t start[M61_NLOCKS];
+  memset(start, 0, sizeof(start));
+  for(size_t i = 0; i < n; ++i)
+  {
+    buckets[i] = node_bucket(keys[i]);
+    ++start[buckets[i] & (M61_NLOCKS - 1)];
+  }
+  size_t pos = 0;
+  for(size_t l = 0; l < M61_NLOCKS; ++l)
+  {
+    size_t cnt = start[l];
+    start[l] = pos;
+    pos += cnt;
+  }
+  for(size_t i = 0; i < n; ++i)
+    order[start[buckets[i] & (M61_NLOCKS - 1)]++] = i;
+}
+
+
+/*find_nodes()
+Purpose: find_node() for a batch of header pointers.
+Arguments:
+    keys: memory header pointers.
+    nodes: output node pointers, NULL where not found.
+    n: number of keys, at most M61_BATCHCHUNK.
+Return:
+*/
+static void find_nodes(void* const* keys, listNode** nodes, size_t n)
+{
+  size_t buckets[M61_BATCHCHUNK];
+  size_t order[M61_BATCHCHUNK];
+  order_by_lock(keys, n, buckets, order);
+
+  pthread_mutex_t* held = NULL;
+  for(size_t k = 0; k < n; ++k)
+  {
+    size_t i = order[k];
+    pthread_mutex_t* lock = &nodeLocks[buckets[i] & (M61_NLOCKS - 1)];
+    if(lock != held)
     {
-	temp = (listNode*)(temp->next);
-	cnt++;
+      if(held != NULL)
+	pthread_mutex_unlock(held);
+      pthread_mutex_lock(lock);
+      held = lock;
     }
-    return cnt;
+    listNode* temp = nodeTable[buckets[i]];
+    while(temp != NULL && temp->memPtr != keys[i])
+      temp = temp->hashNext;
+    nodes[i] = temp;
+  }
+  if(held != NULL)
+    pthread_mutex_unlock(held);
 }
 
 
-/*find_node()
-Purpose: to check a node in the list.
+/*hash_nodes()
+Purpose: hash_node() for a batch of freshly allocated nodes.
 Arguments:
-    pLookUpPtr: input memory header pointer to check in list.
+    nodes: nodes to add.
+    n: number of nodes, at most M61_BATCHCHUNK.
 Return:
-    the node pointer.
 */
-listNode* find_node(void* pLookUpPtr)
+static void hash_nodes(listNode** nodes, size_t n)
 {
-    listNode* temp = head;
-    while(temp != NULL)
+  void* keys[M61_BATCHCHUNK];
+  size_t buckets[M61_BATCHCHUNK];
+  size_t order[M61_BATCHCHUNK];
+  for(size_t i = 0; i < n; ++i)
+    keys[i] = nodes[i]->memPtr;
+  order_by_lock(keys, n, buckets, order);
+
+  pthread_mutex_t* held = NULL;
+  for(size_t k = 0; k < n; ++k)
+  {
+    listNode* current = nodes[order[k]];
+    size_t b = buckets[order[k]];
+    pthread_mutex_t* lock = &nodeLocks[b & (M61_NLOCKS - 1)];
+    if(lock != held)
     {
-	if(((MemAllocHeader*)(temp->memPtr)) == (MemAllocHeader*)pLookUpPtr)
-	{
-	    return temp;
-	}
-	else
-	{
-	    temp = (listNode*)(temp->next);
-	}
+      if(held != NULL)
+	pthread_mutex_unlock(held);
+      pthread_mutex_lock(lock);
+      held = lock;
     }
-    return NULL;
+    listNode** pprev = &nodeTable[b];
+    while(*pprev != NULL)
+    {
+      if((*pprev)->memPtr == current->memPtr)
+	*pprev = (*pprev)->hashNext;
+      else
+	pprev = &(*pprev)->hashNext;
+    }
+    current->hashNext = nodeTable[b];
+    nodeTable[b] = current;
+  }
+  if(held != NULL)
+    pthread_mutex_unlock(held);
 }
 
 
@@ -179,21 +425,34 @@ Return:
     '0' for not found, else '1'
 */
 static int check_not_allocated_ptr(const void *pLookUpPtr, listNode** pNodePtr) {
-  
+
   const char  *a = (const char *) pLookUpPtr;
-  listNode* temp = head;
+  m61_arena* arena = __atomic_load_n(&arenaList, __ATOMIC_ACQUIRE);
+  for(; arena != NULL; arena = arena->next)
+  {
+    pthread_mutex_lock(&arena->listLock);
+    listNode* temp = arena->head;
     while(temp != NULL)
     {
+      if(__atomic_load_n(&temp->IsFree, __ATOMIC_ACQUIRE))
+	{
+	  //The block may already be back in the system allocator.
+	  temp = (listNode*) temp->next;
+	  continue;
+	}
       size_t payLoadSize = ((MemAllocHeader*)temp->memPtr)->payLoadSize;
       char *b = (char*) temp->memPtr;
       if (a >= b && a < (b + sizeof(MemAllocHeader) + payLoadSize) )
 	{
+	  pthread_mutex_unlock(&arena->listLock);
 	  *pNodePtr = temp;
 	  return 1;
 	}
-   
+
       temp = (listNode*) temp->next;
     }
+    pthread_mutex_unlock(&arena->listLock);
+  }
       return 0;
 }
 
@@ -212,95 +471,707 @@ void* get_footer(void* ptr, size_t sz)
   return footerPtr;
 }
 
+
+/*want_guard()
+Purpose: decide whether an allocation gets a guard page.
+Arguments:
+    sz: requested size.
+Return:
+    'true' or 'false'
+*/
+static bool want_guard(size_t sz)
+{
+  if(guardMin != 0 && sz >= guardMin)
+    return true;
+  return guardSample != 0 && ++guardTick % guardSample == 0;
+}
+
+
+/*guard_alloc()
+Purpose: set up a block whose payload ends flush against a guard page,
+reusing a cached mapping when one is big enough.
+Arguments:
+    sz: requested size.
+    pMapSize: output, size of the mapping.
+    pSlot: output, guard-table slot; fill in its node once it exists.
+Return:
+    the block's header, or NULL if the block should be allocated normally.
+*/
+static MemAllocHeader* guard_alloc(size_t sz, size_t* pMapSize, int* pSlot)
+{
+  if(sz > SIZE_MAX / 2)
+    return NULL;
+  size_t rounded = (sz + 15) & ~(size_t) 15;
+  size_t need = ((sizeof(MemAllocHeader) + rounded + pageSize - 1) & ~(pageSize - 1)) + pageSize;
+
+  char* base = NULL;
+  size_t mapSize = 0;
+  pthread_mutex_lock(&guardLock);
+  int best = -1;
+  for(int i = 0; i < nGuardCache; ++i)
+    if(guardCache[i].mapSize >= need && guardCache[i].mapSize <= 2 * need
+       && (best < 0 || guardCache[i].mapSize < guardCache[best].mapSize))
+      best = i;
+  if(best >= 0)
+  {
+    base = guardCache[best].base;
+    mapSize = guardCache[best].mapSize;
+    guardCache[best] = guardCache[--nGuardCache];
+  }
+  pthread_mutex_unlock(&guardLock);
+
+  if(base == NULL)
+  {
+    base = (char*) mmap(NULL, need, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+      return NULL;
+    mapSize = need;
+    mprotect(base + mapSize - pageSize, pageSize, PROT_NONE);
+  }
+
+  char* guard = base + mapSize - pageSize;
+  int slot;
+  for(slot = 0; slot < M61_MAXGUARDS; ++slot)
+  {
+    char* expected = NULL;
+    if(__atomic_compare_exchange_n(&guardTable[slot].guardPage, &expected, guard, false,
+				   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+  if(slot == M61_MAXGUARDS)
+  {
+    munmap(base, mapSize);
+    return NULL;
+  }
+
+  char* payloadPtr = guard - rounded;
+  memset(payloadPtr + sz, M61_SLACKBYTE, rounded - sz);
+  *pMapSize = mapSize;
+  *pSlot = slot;
+  return ((MemAllocHeader*) payloadPtr) - 1;
+}
+
+
+/*guard_release()
+Purpose: retire a guarded block and keep its mapping for reuse.
+Arguments:
+    pHeader: header of the freed block.
+Return:
+*/
+static void guard_release(MemAllocHeader* pHeader)
+{
+  listNode* node = pHeader->node;
+  size_t rounded = (pHeader->payLoadSize + 15) & ~(size_t) 15;
+  char* guard = (char*) (pHeader + 1) + rounded;
+  char* base = guard + pageSize - node->mapSize;
+  size_t mapSize = node->mapSize;
+
+  __atomic_store_n(&guardTable[node->guardSlot].node, NULL, __ATOMIC_RELEASE);
+  __atomic_store_n(&guardTable[node->guardSlot].guardPage, NULL, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock(&guardLock);
+  if(nGuardCache < M61_GUARDCACHE)
+  {
+    guardCache[nGuardCache].base = base;
+    guardCache[nGuardCache].mapSize = mapSize;
+    ++nGuardCache;
+    base = NULL;
+  }
+  pthread_mutex_unlock(&guardLock);
+  if(base != NULL)
+    munmap(base, mapSize);
+}
+
+
+/*block_intact()
+Purpose: check the bytes just past a block's payload: the footer for a
+normal block, the alignment slack for a guarded one.
+Arguments:
+    ptr: payload pointer.
+    pHeader: its header.
+    node: its list node.
+Return:
+    'true' if nothing wrote past the payload.
+*/
+static bool block_intact(void* ptr, MemAllocHeader* pHeader, listNode* node)
+{
+  size_t sz = pHeader->payLoadSize;
+  if(node->mapSize == 0)
+    return ((MemAllocFooter*)get_footer(ptr, sz))->footerValue == (size_t) -1;
+
+  const unsigned char* slack = (const unsigned char*) ptr + sz;
+  size_t rounded = (sz + 15) & ~(size_t) 15;
+  for(size_t i = 0; i < rounded - sz; ++i)
+    if(slack[i] != M61_SLACKBYTE)
+      return false;
+  return true;
+}
+
+
+/*release_block()
+Purpose: return a freed block to its owner: small blocks go on the
+owner's size-class free list until it is full, guarded blocks go to the
+mapping cache, everything else goes back to the system allocator, and
+its node is retired. Statistics are left to the caller. The caller
+must own the arena.
+Arguments:
+    arena: owner of the block.
+    pHeader: header of the freed block.
+Return:
+*/
+static void release_block(m61_arena* arena, MemAllocHeader* pHeader)
+{
+  size_t sz = pHeader->payLoadSize;
+  listNode* node = pHeader->node;
+  if(node->mapSize != 0)
+  {
+    guard_release(pHeader);
+    retire_node(arena, node);
+    return;
+  }
+  if(sz <= M61_SMALL_MAX)
+  {
+    size_t c = M61_SIZECLASS(sz);
+    if(arena->freeCount[c] < M61_CLASSCACHE)
+    {
+      pHeader->nextFree = arena->freeList[c];
+      arena->freeList[c] = pHeader;
+      ++arena->freeCount[c];
+      return;
+    }
+  }
+  free((void*)pHeader);
+  retire_node(arena, node);
+}
+
+
+/*drain_remote_frees()
+Purpose: release every block other threads have pushed onto an arena's
+remote-free list. The whole list is taken with one atomic exchange, so
+the statistics are updated once per batch rather than once per block.
+The caller must own the arena.
+Arguments:
+    arena: arena to drain.
+Return:
+*/
+static void drain_remote_frees(m61_arena* arena)
+{
+  MemAllocHeader* pHeader = __atomic_exchange_n(&arena->remoteFree, NULL, __ATOMIC_ACQUIRE);
+  unsigned long long count = 0, size = 0;
+
+  while(pHeader != NULL)
+  {
+    MemAllocHeader* next = pHeader->nextFree;
+    ++count;
+    size += pHeader->payLoadSize;
+    release_block(arena, pHeader);
+    pHeader = next;
+  }
+
+  M61_COUNT(arena->mActive_Count, -count);
+  M61_COUNT(arena->mActive_Size, -size);
+}
+
+
+/*push_remote_free()
+Purpose: hand a chain of blocks back to the arena that allocated them.
+Any number of threads may push concurrently; only the owner pops, and it
+always takes the whole list, so a plain compare-and-swap push is
+ABA-safe.
+Arguments:
+    arena: owner of the blocks.
+    first, last: ends of a chain linked through `nextFree`.
+Return:
+*/
+static void push_remote_free(m61_arena* arena, MemAllocHeader* first, MemAllocHeader* last)
+{
+  MemAllocHeader* old = __atomic_load_n(&arena->remoteFree, __ATOMIC_RELAXED);
+  do
+  {
+    last->nextFree = old;
+  } while(!__atomic_compare_exchange_n(&arena->remoteFree, &old, first, true,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/*release_arena()
+Purpose: thread-exit destructor. Drains the arena and marks it free so
+the next new thread adopts it instead of creating another one. The
+thread's own pointers to it are cleared first: a later TLS destructor
+that allocates gets an arena of its own, which is released on the next
+destructor round.
+Arguments:
+    ptr: the exiting thread's arena.
+Return:
+*/
+static void release_arena(void* ptr)
+{
+  m61_arena* arena = (m61_arena*) ptr;
+  myArena = NULL;
+  m61_fastArena = NULL;
+  M61_LOCK();
+  drain_remote_frees(arena);
+  M61_UNLOCK();
+  __atomic_store_n(&arena->inUse, 0, __ATOMIC_RELEASE);
+}
+
+/*rearm()
+Purpose: recompute m61_debugArmed after the configuration changes.
+*/
+static void rearm(void)
+{
+  __atomic_store_n(&m61_debugArmed,
+		   limitBytes != 0 || failThreshold != 0 || nFailSites != 0
+		   || guardMin != 0 || guardSample != 0,
+		   __ATOMIC_RELEASE);
+}
+
+
+/*next_setting()
+Purpose: split the next `key=value` item off a comma-separated setting
+string. Items without '=' are skipped.
+Arguments:
+    spec: the setting string; advanced past the item.
+    item: buffer for the item; the key is NUL-terminated in place.
+    itemSize: size of `item`.
+Return:
+    the value, or NULL when the string is used up.
+*/
+static char* next_setting(const char** spec, char* item, size_t itemSize)
+{
+  while(**spec != '\0')
+  {
+    size_t len = strcspn(*spec, ",");
+    snprintf(item, itemSize, "%.*s", (int) len, *spec);
+    *spec += len + ((*spec)[len] == ',');
+
+    char* value = strchr(item, '=');
+    if(value != NULL)
+    {
+      *value = '\0';
+      return value + 1;
+    }
+  }
+  return NULL;
+}
+
+
+/*parse_fail_spec()
+Purpose: parse the M61_FAIL settings described above. Unknown keys are
+reported on stderr and ignored.
+Arguments:
+    spec: the setting string.
+Return:
+*/
+static void parse_fail_spec(const char* spec)
+{
+  char item[160];
+  char* value;
+  while((value = next_setting(&spec, item, sizeof(item))) != NULL)
+  {
+    if(strcmp(item, "limit") == 0)
+      limitBytes = strtoull(value, NULL, 0);
+    else if(strcmp(item, "rate") == 0)
+    {
+      double rate = strtod(value, NULL);
+      //A rate just below 1 still rounds up to 2^64, which doesn't fit.
+      double threshold = rate * 18446744073709551616.0;
+      if(threshold >= 18446744073709551616.0)
+	failThreshold = UINT64_MAX;
+      else if(rate > 0.0)
+	failThreshold = (uint64_t) threshold;
+    }
+    else if(strcmp(item, "seed") == 0)
+      failSeed = strtoull(value, NULL, 0);
+    else if(strcmp(item, "site") == 0 && nFailSites < M61_MAXSITES)
+    {
+      failSite* site = &failSites[nFailSites++];
+      char* colon = strrchr(value, ':');
+      site->line = 0;
+      if(colon != NULL)
+      {
+	*colon = '\0';
+	site->line = atoi(colon + 1);
+      }
+      snprintf(site->file, sizeof(site->file), "%s", value);
+    }
+    else
+      fprintf(stderr, "m61: ignoring M61_FAIL setting `%s`\n", item);
+  }
+}
+
+
+/*put_str(), put_num()
+Purpose: append a string, or a number in base 10 or 16 ("0x" prefixed),
+to `buf` at `*len`, truncating at `size`. Unlike snprintf they are
+async-signal-safe, so guard_fault can use them.
+*/
+static void put_str(char* buf, size_t size, size_t* len, const char* str)
+{
+  for(; *str != '\0' && *len < size; ++str)
+    buf[(*len)++] = *str;
+}
+
+static void put_num(char* buf, size_t size, size_t* len, uintmax_t value, unsigned base)
+{
+  char digits[24];
+  int n = 0;
+  do
+  {
+    digits[n++] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while(value != 0);
+  if(base == 16)
+    put_str(buf, size, len, "0x");
+  while(n > 0 && *len < size)
+    buf[(*len)++] = digits[--n];
+}
+
+
+/*guard_fault()
+Purpose: SIGSEGV handler for guard-page mode. If the fault hit a guard
+page, report the overflowing block and its allocation site on stderr.
+Either way the previous handler is reinstated, so returning re-executes
+the access and it takes the usual action.
+*/
+static void guard_fault(int sig, siginfo_t* si, void* context)
+{
+  (void) sig, (void) context;
+  char* addr = (char*) si->si_addr;
+  for(int i = 0; i < M61_MAXGUARDS; ++i)
+  {
+    char* guard = __atomic_load_n(&guardTable[i].guardPage, __ATOMIC_ACQUIRE);
+    listNode* node = __atomic_load_n(&guardTable[i].node, __ATOMIC_ACQUIRE);
+    if(guard == NULL || node == NULL || addr < guard || addr >= guard + pageSize)
+      continue;
+
+    MemAllocHeader* pHeader = (MemAllocHeader*) node->memPtr;
+    char* payloadPtr = (char*) (pHeader + 1);
+    char buf[512];
+    size_t n = 0;
+    put_str(buf, sizeof(buf), &n, "MEMORY BUG: wild access at ");
+    put_num(buf, sizeof(buf), &n, (uintptr_t) addr, 16);
+    put_str(buf, sizeof(buf), &n, ", ");
+    put_num(buf, sizeof(buf), &n, addr - payloadPtr - pHeader->payLoadSize, 10);
+    put_str(buf, sizeof(buf), &n, " bytes past the end of pointer ");
+    put_num(buf, sizeof(buf), &n, (uintptr_t) payloadPtr, 16);
+    put_str(buf, sizeof(buf), &n, "\n  ");
+    put_str(buf, sizeof(buf), &n, node->allocFileName);
+    put_str(buf, sizeof(buf), &n, ":");
+    put_num(buf, sizeof(buf), &n, node->allocLineNum, 10);
+    put_str(buf, sizeof(buf), &n, ": ");
+    put_num(buf, sizeof(buf), &n, (uintptr_t) payloadPtr, 16);
+    put_str(buf, sizeof(buf), &n, " is a ");
+    put_num(buf, sizeof(buf), &n, pHeader->payLoadSize, 10);
+    put_str(buf, sizeof(buf), &n, " byte region allocated here\n");
+    ssize_t w = write(STDERR_FILENO, buf, n);
+    (void) w;
+    break;
+  }
+  sigaction(SIGSEGV, &oldSegvAction, NULL);
+}
+
+
+/*parse_guard_spec()
+Purpose: parse the M61_GUARD settings described above, and install the
+fault handler if guard pages are on.
+Arguments:
+    spec: the setting string.
+Return:
+*/
+static void parse_guard_spec(const char* spec)
+{
+  char item[160];
+  char* value;
+  while((value = next_setting(&spec, item, sizeof(item))) != NULL)
+  {
+    if(strcmp(item, "min") == 0)
+      guardMin = strtoull(value, NULL, 0);
+    else if(strcmp(item, "sample") == 0)
+      guardSample = strtoul(value, NULL, 0);
+    else
+      fprintf(stderr, "m61: ignoring M61_GUARD setting `%s`\n", item);
+  }
+
+  if(guardMin != 0 || guardSample != 0)
+  {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = guard_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &oldSegvAction);
+  }
+}
+
+static void m61_init(void)
+{
+  pthread_key_create(&arenaKey, release_arena);
+  pageSize = sysconf(_SC_PAGESIZE);
+  const char* spec = getenv("M61_FAIL");
+  if(spec != NULL)
+    parse_fail_spec(spec);
+  spec = getenv("M61_GUARD");
+  if(spec != NULL)
+    parse_guard_spec(spec);
+  rearm();
+}
+
+
+/*site_matches()
+Purpose: check whether a call site is one of the configured failing sites.
+`site=parse.c` matches "parse.c" and "src/parse.c".
+Arguments:
+    site: configured site.
+    file, line: call site.
+Return:
+    'true' or 'false'
+*/
+static bool site_matches(const failSite* site, const char* file, int line)
+{
+  if(site->line != 0 && site->line != line)
+    return false;
+  size_t flen = strlen(file), slen = strlen(site->file);
+  return flen >= slen && strcmp(file + flen - slen, site->file) == 0
+    && (flen == slen || file[flen - slen - 1] == '/');
+}
+
+
+/*should_fail()
+Purpose: decide whether an allocation must fail because of the limit or
+failure injection, charging it against the limit if it may proceed.
+Only called while m61_debugArmed is set.
+Arguments:
+    sz, file, line: as for m61_malloc.
+Return:
+    'true' if the allocation must fail.
+*/
+static bool should_fail(size_t sz, const char* file, int line)
+{
+  for(int i = 0; i < nFailSites; ++i)
+    if(site_matches(&failSites[i], file, line))
+      return true;
+
+  if(failThreshold != 0)
+  {
+    uint64_t x = failRandState;
+    if(x == 0)
+      x = failSeed + 0x9E3779B97F4A7C15ULL * __atomic_add_fetch(&failThreadCount, 1, __ATOMIC_RELAXED);
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    failRandState = x;
+    if(x * 0x2545F4914F6CDD1DULL < failThreshold)
+      return true;
+  }
+
+  if(limitBytes != 0)
+  {
+    size_t used = __atomic_add_fetch(&limitUsed, sz, __ATOMIC_RELAXED);
+    if(used > limitBytes || used < sz)
+    {
+      __atomic_sub_fetch(&limitUsed, sz, __ATOMIC_RELAXED);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*uncharge()
+Purpose: give freed bytes back to the limit.
+Arguments:
+    sz: bytes freed.
+Return:
+*/
+static inline void uncharge(size_t sz)
+{
+  if(__builtin_expect(m61_debugArmed, 0) && limitBytes != 0)
+    __atomic_sub_fetch(&limitUsed, sz, __ATOMIC_RELAXED);
+}
+
+
+/*get_arena()
+Purpose: return the calling thread's arena, adopting an arena left by an
+exited thread or creating a new one on first use.
+Arguments:
+Return:
+    the arena pointer.
+*/
+static m61_arena* get_arena(void)
+{
+  if(myArena != NULL)
+    return myArena;
+
+  pthread_once(&initOnce, m61_init);
+
+  m61_arena* arena = __atomic_load_n(&arenaList, __ATOMIC_ACQUIRE);
+  for(; arena != NULL; arena = arena->next)
+  {
+    int unused = 0;
+    if(__atomic_compare_exchange_n(&arena->inUse, &unused, 1, false,
+				   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if(arena == NULL)
+  {
+    arena = (m61_arena*) calloc(1, sizeof(m61_arena));
+    assert(arena != NULL);
+    pthread_mutex_init(&arena->listLock, NULL);
+    arena->inUse = 1;
+    arena->next = __atomic_load_n(&arenaList, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&arenaList, &arena->next, arena, true,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      /* retry */;
+  }
+
+  myArena = arena;
+  if(!M61_GLOBAL_LOCK)
+    m61_fastArena = arena;
+  pthread_setspecific(arenaKey, arena);
+  return arena;
+}
+
 void *m61_malloc(size_t sz, const char *file, int line) {
     (void) file, (void) line;	// avoid uninitialized variable warnings
 
+    M61_LOCK();
+    m61_arena* self = get_arena();
+    if(__atomic_load_n(&self->remoteFree, __ATOMIC_RELAXED) != NULL)
+      drain_remote_frees(self);
+
     //Size of the Header.
     size_t headerSize = sizeof(MemAllocHeader);
     size_t footerSize = sizeof(MemAllocFooter);
-    
+
     //Memory allocation of the block.
+    void *payloadPtr = NULL;
+    if(__builtin_expect(m61_debugArmed, 0) && should_fail(sz, file, line))
+    {
+      M61_COUNT(self->mFail_Count, 1);
+      M61_COUNT(self->mFail_Size, sz);
+      M61_UNLOCK();
+      return NULL;
+    }
+    bool guarded = __builtin_expect(m61_debugArmed, 0) && want_guard(sz);
+    if(!guarded && sz <= M61_SMALL_MAX
+       && (payloadPtr = m61_pop_free(self, sz, file, line)) != NULL)
+    {
+      M61_UNLOCK();
+      return payloadPtr;
+    }
+
+    //Small blocks get their whole size class, so they can be reused for
+    //any size in the class.
+    size_t capacity = sz;
+    if(sz <= M61_SMALL_MAX)
+      capacity = M61_SIZECLASS(sz) * M61_CLASSGRAIN;
+
     void *memBlockPtr = NULL;
-    if( sz < SIZE_MAX)
-    {   
-      size_t newSizeToAllocate = sz + headerSize + footerSize;
+    size_t mapSize = 0;
+    int guardSlot = 0;
+    if(guarded)
+      memBlockPtr = guard_alloc(sz, &mapSize, &guardSlot);
+    if( memBlockPtr == NULL && sz < SIZE_MAX)
+    {
+      size_t newSizeToAllocate = capacity + headerSize + footerSize;
       memBlockPtr = malloc(newSizeToAllocate);
     }
-    void *payloadPtr = NULL;
 
     //Memory allocation successful, increment the counters.
-    if(memBlockPtr != NULL) 
+    if(memBlockPtr != NULL)
     {
-      listNode* newListNode = create_node(memBlockPtr);
+      ((MemAllocHeader*)memBlockPtr)->payLoadSize = sz;
+      ((MemAllocHeader*)memBlockPtr)->owner = self;
+      ((MemAllocHeader*)memBlockPtr)->nextFree = NULL;
+
+      listNode* newListNode = create_node(self, memBlockPtr);
       newListNode->allocLineNum = line;
-      newListNode->allocFileName = (char*) malloc(strlen(file)+1);
-      strcpy(newListNode->allocFileName, file);
-		    
-      insert_node(newListNode);
+      newListNode->allocFileName = file;
+      ((MemAllocHeader*)memBlockPtr)->node = newListNode;
+      newListNode->mapSize = mapSize;
+      newListNode->guardSlot = guardSlot;
 
-      ++mTotalAlloc_Count;
-    
-      ((MemAllocHeader*)memBlockPtr)->payLoadSize = sz;
-      
-      mTotalAlloc_Size += sz;
-      mActive_Size += sz;
-      ++mActive_Count;
+      insert_node(self, newListNode);
+      hash_node(newListNode);
+
+      M61_COUNT(self->mTotalAlloc_Count, 1);
+
+      M61_COUNT(self->mTotalAlloc_Size, sz);
+      M61_COUNT(self->mActive_Size, sz);
+      M61_COUNT(self->mActive_Count, 1);
       //Get the payload pointer and return it.
       payloadPtr = ((MemAllocHeader*)memBlockPtr) + 1;
 
-      MemAllocFooter* pFooter = (MemAllocFooter*)get_footer(payloadPtr, sz);
-      pFooter->footerValue = (size_t) -1;
+      if(mapSize != 0)
+	__atomic_store_n(&guardTable[guardSlot].node, newListNode, __ATOMIC_RELEASE);
+      else
+      {
+	MemAllocFooter* pFooter = (MemAllocFooter*)get_footer(payloadPtr, sz);
+	pFooter->footerValue = (size_t) -1;
+      }
     }
     else
     {
-      ++mFail_Count;
-      mFail_Size += (sz);
+      uncharge(sz);
+      M61_COUNT(self->mFail_Count, 1);
+      M61_COUNT(self->mFail_Size, sz);
     }
-    
+
+    M61_UNLOCK();
     return payloadPtr;
 }
 
 void m61_free(void *ptr, const char *file, int line) {
     (void) file, (void) line;	// avoid uninitialized variable warnings
-    
+
     if(ptr != NULL)
     {
+      M61_LOCK();
+      m61_arena* self = get_arena();
       MemAllocHeader* pHeader =  ((MemAllocHeader*)ptr)-1;
       listNode* current_node = NULL;
 
-      int num_ListNodes = count_node();
-
       current_node = find_node((void*)pHeader);
       if(current_node != NULL)
       {
-	if(current_node->IsFree)
+	if(__atomic_load_n(&current_node->IsFree, __ATOMIC_ACQUIRE))
 	  {
 	    int oldLine = current_node->lineNum;
-	    char* oldFileName = current_node->fileName;
+	    const char* oldFileName = current_node->fileName;
 	    printf("MEMORY BUG: %s:%d: double free of pointer %p\n  %s:%d: pointer %p previously freed here", file, line, ptr, oldFileName, oldLine, ptr);
 	    abort();
 	  }
 	else
 	  {
 	    size_t payloadSize = pHeader->payLoadSize;
-	    MemAllocFooter* pFooter = NULL;
-	    pFooter = (MemAllocFooter*)get_footer(ptr, payloadSize);
-	    if(pFooter && pFooter->footerValue != ((size_t) -1))
+	    if(!block_intact(ptr, pHeader, current_node))
 	      {
 		printf("MEMORY BUG %s %d: detected wild write during free of pointer %p", file, line, ptr);
-		abort();	     
+		abort();
+	      }
+	    else if(!__sync_bool_compare_and_swap(&current_node->IsFree, false, true))
+	      {
+		//Another thread freed the block since the check above.
+		printf("MEMORY BUG: %s:%d: double free of pointer %p", file, line, ptr);
+		abort();
 	      }
 	    else
 	      {
-		bool check = current_node->IsFree;
-		current_node->IsFree = true;
 		current_node->lineNum = line;
-		current_node->fileName = (char*) malloc(strlen(file)+1);
-		strcpy(current_node->fileName, file);
-		size_t payloadSize = pHeader->payLoadSize;
-		mActive_Size -= payloadSize;
-		free((void*)pHeader);
-		--mActive_Count;   
+		current_node->fileName = file;
+		uncharge(payloadSize);
+
+		m61_arena* owner = pHeader->owner;
+		if(M61_GLOBAL_LOCK || owner == self)
+		  {
+		    M61_COUNT(owner->mActive_Size, -payloadSize);
+		    release_block(owner, pHeader);
+		    M61_COUNT(owner->mActive_Count, -1);
+		  }
+		else
+		  push_remote_free(owner, pHeader, pHeader);
 	      }
 	  }
       }
@@ -315,7 +1186,7 @@ void m61_free(void *ptr, const char *file, int line) {
 	    printf("  %s:%d: %p is %zu bytes inside a %zu byte region allocated here",  pNode->allocFileName,
 		       pNode->allocLineNum, ptr, sizeDiff, ((MemAllocHeader*)pNode->memPtr)->payLoadSize);
 	    abort();
-		
+
 	  }
 	  else
 	  {
@@ -323,16 +1194,226 @@ void m61_free(void *ptr, const char *file, int line) {
 	    abort();
 	  }
 	}
+      M61_UNLOCK();
+    }
+}
+
+/*m61_malloc_batch()
+Purpose: allocate `n` blocks of `sz` bytes each into `ptrs`. Cached
+blocks are used first; the rest share one list-node allocation, one pass
+over the lookup-table locks and one statistics update.
+Arguments:
+    sz: size of each block.
+    n: number of blocks.
+    ptrs: output array of `n` payload pointers.
+    file, line: call site.
+Return:
+    number of blocks allocated. On failure the remaining entries of
+    `ptrs` are NULL and each counts as a failed allocation.
+*/
+size_t m61_malloc_batch(size_t sz, size_t n, void **ptrs, const char *file, int line) {
+    if(__builtin_expect(m61_debugArmed, 0))
+    {
+      //Every block must pass the limit and injection checks on its own.
+      size_t i;
+      for(i = 0; i < n && (ptrs[i] = m61_malloc(sz, file, line)) != NULL; ++i)
+	/* do nothing */;
+      return i;
+    }
+
+    M61_LOCK();
+    m61_arena* self = get_arena();
+    if(__atomic_load_n(&self->remoteFree, __ATOMIC_RELAXED) != NULL)
+      drain_remote_frees(self);
+
+    size_t i = 0;
+    if(sz <= M61_SMALL_MAX)
+      while(i < n && (ptrs[i] = m61_pop_free(self, sz, file, line)) != NULL)
+	++i;
+
+    size_t nmiss = n - i;
+    size_t capacity = sz;
+    if(sz <= M61_SMALL_MAX)
+      capacity = M61_SIZECLASS(sz) * M61_CLASSGRAIN;
+
+    //Recycled nodes first; the rest share one allocation.
+    size_t nfresh = 0, nspare = 0, nblock = 0;
+    for(listNode* node = self->spareNodes; node != NULL && nspare < nmiss; node = node->next)
+      ++nspare;
+    listNode* nodeBlock = NULL;
+    if(nmiss > nspare && sz < SIZE_MAX)
+      nodeBlock = (listNode*) calloc(nmiss - nspare, sizeof(listNode));
+    if(nodeBlock != NULL || (nmiss != 0 && nspare == nmiss && sz < SIZE_MAX))
+    {
+      listNode* fresh[M61_BATCHCHUNK];
+      size_t newSizeToAllocate = capacity + sizeof(MemAllocHeader) + sizeof(MemAllocFooter);
+      bool failed = false;
+
+      while(nfresh < nmiss && !failed)
+      {
+	size_t nchunk = 0;
+	pthread_mutex_lock(&self->listLock);
+	for(; nchunk < M61_BATCHCHUNK && nfresh < nmiss; ++nchunk, ++nfresh)
+	{
+	  MemAllocHeader* pHeader = (MemAllocHeader*) malloc(newSizeToAllocate);
+	  if(pHeader == NULL)
+	  {
+	    failed = true;
+	    break;
+	  }
+	  listNode* node = take_node(self);
+	  if(node == NULL)
+	    node = &nodeBlock[nblock++];
+	  node->memPtr = pHeader;
+	  node->allocFileName = file;
+	  node->allocLineNum = line;
+	  link_node(self, node);
+	  fresh[nchunk] = node;
+
+	  pHeader->payLoadSize = sz;
+	  pHeader->owner = self;
+	  pHeader->nextFree = NULL;
+	  pHeader->node = node;
+	  ptrs[i + nfresh] = pHeader + 1;
+	  ((MemAllocFooter*)get_footer(pHeader + 1, sz))->footerValue = (size_t) -1;
+	}
+	pthread_mutex_unlock(&self->listLock);
+	hash_nodes(fresh, nchunk);
+      }
+      if(nblock == 0)
+	free(nodeBlock);
+      else
+	//A failed malloc leaves the rest of the block for later nodes.
+	for(size_t k = nblock; k < nmiss - nspare; ++k)
+	{
+	  nodeBlock[k].next = self->spareNodes;
+	  self->spareNodes = &nodeBlock[k];
+	}
+    }
+
+    M61_COUNT(self->mTotalAlloc_Count, nfresh);
+    M61_COUNT(self->mTotalAlloc_Size, sz * nfresh);
+    M61_COUNT(self->mActive_Count, nfresh);
+    M61_COUNT(self->mActive_Size, sz * nfresh);
+    i += nfresh;
+
+    if(i < n)
+    {
+      M61_COUNT(self->mFail_Count, n - i);
+      M61_COUNT(self->mFail_Size, sz * (n - i));
+      memset(&ptrs[i], 0, (n - i) * sizeof(void*));
+    }
+
+    M61_UNLOCK();
+    return i;
+}
+
+
+/*m61_free_batch()
+Purpose: free `n` blocks. Lookups are grouped by lock, headers are
+prefetched ahead of the scan, statistics are updated once per chunk, and
+runs of blocks owned by the same other thread are pushed with a single
+compare-and-swap. Any invalid block is reported exactly as m61_free
+would report it.
+Arguments:
+    ptrs: payload pointers (NULL entries are ignored).
+    n: number of pointers.
+    file, line: call site.
+Return:
+*/
+void m61_free_batch(void **ptrs, size_t n, const char *file, int line) {
+    void* keys[M61_BATCHCHUNK];
+    listNode* nodes[M61_BATCHCHUNK];
+
+    for(; n != 0; )
+    {
+      size_t chunk = n < M61_BATCHCHUNK ? n : M61_BATCHCHUNK;
+
+      M61_LOCK();
+      m61_arena* self = get_arena();
+      for(size_t i = 0; i < chunk; ++i)
+	keys[i] = ptrs[i] ? ((MemAllocHeader*)ptrs[i]) - 1 : NULL;
+      find_nodes(keys, nodes, chunk);
+
+      unsigned long long count = 0, size = 0, remoteSize = 0;
+      m61_arena* chainOwner = NULL;
+      MemAllocHeader* chainFirst = NULL;
+      MemAllocHeader* chainLast = NULL;
+
+      for(size_t i = 0; i < chunk; ++i)
+      {
+	if(i + 8 < chunk && keys[i + 8] != NULL)
+	  __builtin_prefetch(keys[i + 8]);
+	if(ptrs[i] == NULL)
+	  continue;
+
+	MemAllocHeader* pHeader = (MemAllocHeader*) keys[i];
+	listNode* current_node = nodes[i];
+	if(current_node == NULL || __atomic_load_n(&current_node->IsFree, __ATOMIC_ACQUIRE)
+	   || !block_intact(ptrs[i], pHeader, current_node)
+	   || !__sync_bool_compare_and_swap(&current_node->IsFree, false, true))
+	{
+	  //Let m61_free produce the usual report.
+	  M61_UNLOCK();
+	  m61_free(ptrs[i], file, line);
+	  M61_LOCK();
+	  continue;
+	}
+	current_node->lineNum = line;
+	current_node->fileName = file;
+
+	m61_arena* owner = pHeader->owner;
+	if(owner == self)
+	{
+	  ++count;
+	  size += pHeader->payLoadSize;
+	  release_block(self, pHeader);
+	}
+	else if(M61_GLOBAL_LOCK)
+	{
+	  M61_COUNT(owner->mActive_Count, -1);
+	  M61_COUNT(owner->mActive_Size, -pHeader->payLoadSize);
+	  remoteSize += pHeader->payLoadSize;
+	  release_block(owner, pHeader);
+	}
+	else
+	{
+	  remoteSize += pHeader->payLoadSize;
+	  if(owner != chainOwner && chainOwner != NULL)
+	  {
+	    push_remote_free(chainOwner, chainFirst, chainLast);
+	    chainOwner = NULL;
+	  }
+	  if(chainOwner == NULL)
+	  {
+	    chainOwner = owner;
+	    chainFirst = pHeader;
+	  }
+	  else
+	    chainLast->nextFree = pHeader;
+	  chainLast = pHeader;
+	}
+      }
+      if(chainOwner != NULL)
+	push_remote_free(chainOwner, chainFirst, chainLast);
+
+      M61_COUNT(self->mActive_Count, -count);
+      M61_COUNT(self->mActive_Size, -size);
+      uncharge(size + remoteSize);
+      M61_UNLOCK();
+
+      ptrs += chunk;
+      n -= chunk;
     }
 }
 
 void *m61_realloc(void *ptr, size_t sz, const char *file, int line) {
     (void) file, (void) line;	// avoid uninitialized variable warnings
     void* new_ptr = NULL;
-    
+
     if(sz != 0)
       new_ptr = m61_malloc(sz, file, line);
-    
+
     if(ptr != NULL && new_ptr != NULL)
     {
        MemAllocHeader* pHeader =  ((MemAllocHeader*)ptr)-1;
@@ -344,7 +1425,9 @@ void *m61_realloc(void *ptr, size_t sz, const char *file, int line) {
 	 memcpy(new_ptr, ptr, sz);
     }
 
-    m61_free(ptr, file, line);
+    //Like realloc(3), leave the old block alone if the new one failed.
+    if(sz == 0 || new_ptr != NULL)
+      m61_free(ptr, file, line);
     return new_ptr;
 }
 
@@ -356,7 +1439,11 @@ void *m61_calloc(size_t nmemb, size_t sz, const char *file, int line) {
     if( sz < (SIZE_MAX)/nmemb)
       ptr = m61_malloc(nmemb*sz, file, line);
     else
-      ++mFail_Count;
+    {
+      M61_LOCK();
+      M61_COUNT(get_arena()->mFail_Count, 1);
+      M61_UNLOCK();
+    }
 
     if(ptr != NULL)
       memset(ptr, 0, nmemb*sz);
@@ -367,14 +1454,52 @@ void *m61_calloc(size_t nmemb, size_t sz, const char *file, int line) {
 void m61_getstatistics(struct m61_statistics *stats) {
     // Stub: set all statistics to 0
     memset(stats, 0, sizeof(struct m61_statistics));
-    
-    stats->total_count = mTotalAlloc_Count;
-    stats->active_count = mActive_Count;
-    stats->fail_count = mFail_Count;
 
-    stats->total_size = mTotalAlloc_Size;
-    stats->active_size = mActive_Size;
-    stats->fail_size = mFail_Size;
+    M61_LOCK();
+    //Fold in frees that are still queued for this thread, and for arenas
+    //whose threads have exited (claimed so no other thread drains them).
+    drain_remote_frees(get_arena());
+    m61_arena* arena = __atomic_load_n(&arenaList, __ATOMIC_ACQUIRE);
+    for(; arena != NULL; arena = arena->next)
+    {
+      int unused = 0;
+      if(__atomic_compare_exchange_n(&arena->inUse, &unused, 1, false,
+				     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+	drain_remote_frees(arena);
+	__atomic_store_n(&arena->inUse, 0, __ATOMIC_RELEASE);
+      }
+
+      //Other threads may be updating their counters; each load is
+      //atomic, but the sums are only exact once those threads are quiet.
+      stats->total_count += __atomic_load_n(&arena->mTotalAlloc_Count, __ATOMIC_RELAXED);
+      stats->active_count += __atomic_load_n(&arena->mActive_Count, __ATOMIC_RELAXED);
+      stats->fail_count += __atomic_load_n(&arena->mFail_Count, __ATOMIC_RELAXED);
+
+      stats->total_size += __atomic_load_n(&arena->mTotalAlloc_Size, __ATOMIC_RELAXED);
+      stats->active_size += __atomic_load_n(&arena->mActive_Size, __ATOMIC_RELAXED);
+      stats->fail_size += __atomic_load_n(&arena->mFail_Size, __ATOMIC_RELAXED);
+    }
+    M61_UNLOCK();
+}
+
+/*m61_setlimit()
+Purpose: fail allocations that would take active bytes past `limit`
+(0 removes the limit). Blocks that are already active count against the
+new limit, so set it before other threads start allocating.
+Arguments:
+    limit: maximum active bytes.
+Return:
+*/
+void m61_setlimit(size_t limit) {
+    pthread_once(&initOnce, m61_init);
+    struct m61_statistics stats;
+    m61_getstatistics(&stats);
+    M61_LOCK();
+    __atomic_store_n(&limitUsed, (size_t) stats.active_size, __ATOMIC_RELAXED);
+    limitBytes = limit;
+    rearm();
+    M61_UNLOCK();
 }
 
 void m61_printstatistics(void) {
@@ -387,21 +1512,29 @@ malloc size:  active %10llu   total %10llu   fail %10llu\n",
 	   stats.active_size, stats.total_size, stats.fail_size);
 }
 
-void m61_printleakreport(void) 
+void m61_printleakreport(void)
 {
-    listNode* temp = head;
-  
+    M61_LOCK();
+    m61_arena* arena = __atomic_load_n(&arenaList, __ATOMIC_ACQUIRE);
+    for(; arena != NULL; arena = arena->next)
+    {
+    pthread_mutex_lock(&arena->listLock);
+    listNode* temp = arena->head;
+
     while(temp != NULL)
     {
-      if(!(temp->IsFree))
+      if(!__atomic_load_n(&temp->IsFree, __ATOMIC_ACQUIRE))
       {
 	size_t payLoadSize = ((MemAllocHeader*)temp->memPtr)->payLoadSize;
 	void* payLoadPtr = ((MemAllocHeader*)temp->memPtr) + 1;
-	char* fileName = temp->allocFileName;
+	const char* fileName = temp->allocFileName;
 	int lineNum = temp->allocLineNum;
-	  
+
 	printf("LEAK CHECK: %s:%d: allocated object %p with size %zu\n", fileName, lineNum, payLoadPtr, payLoadSize);
       }
       temp = (listNode*)(temp->next);
     }
+    pthread_mutex_unlock(&arena->listLock);
+    }
+    M61_UNLOCK();
 }
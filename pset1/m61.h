@@ -2,11 +2,14 @@
 #define M61_H 1
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 void *m61_malloc(size_t sz, const char *file, int line);
 void m61_free(void *ptr, const char *file, int line);
 void *m61_realloc(void *ptr, size_t sz, const char *file, int line);
 void *m61_calloc(size_t nmemb, size_t sz, const char *file, int line);
+size_t m61_malloc_batch(size_t sz, size_t n, void **ptrs, const char *file, int line);
+void m61_free_batch(void **ptrs, size_t n, const char *file, int line);
 
 struct m61_statistics {
     unsigned long long active_count;	// # active allocations
@@ -20,12 +23,15 @@ struct m61_statistics {
 void m61_getstatistics(struct m61_statistics *stats);
 void m61_printstatistics(void);
 void m61_printleakreport(void);
+void m61_setlimit(size_t limit);
 
 //Memory Header
 typedef struct header
 {
   size_t payLoadSize;
-  size_t Padding;
+  struct m61_arena* owner;    //arena of the thread that allocated the block.
+  struct header* nextFree;    //link on a remote-free or size-class free list.
+  struct listNode* node;      //list node describing this block.
 }MemAllocHeader;
 
 //Memory Footer
@@ -42,19 +48,124 @@ typedef struct listNode
   void* memPtr;           //allocated pointer pointing to header of memory.
   bool IsFree;            //bool, to check if memory hasbeen freed.
   int allocLineNum;       //Line Number at which malloc call has been made.
-  char* allocFileName;    //File Name where malloc call has been made.
+  const char* allocFileName; //File Name where malloc call has been made.
   int lineNum;            //Line Number where free call has been made.
-  char* fileName;         //File Name where free call has been made.
+  const char* fileName;   //File Name where free call has been made.
   struct listNode* next;  //next pointer to list node.
+  struct listNode* hashNext; //next node in the same lookup-table bucket.
+  size_t mapSize;         //size of the guard-page mapping, 0 if none.
+  int guardSlot;          //guard-table slot of a guarded block.
 }listNode;
- 
+
+//Small blocks are rounded up to a multiple of M61_CLASSGRAIN bytes. A
+//freed small block is kept on its owner's free list for that size class
+//and handed out again without touching the system allocator.
+#define M61_CLASSGRAIN 16
+#define M61_SMALL_MAX 1024
+#define M61_NCLASSES (M61_SMALL_MAX / M61_CLASSGRAIN + 1)
+#define M61_CLASSCACHE 64	// max cached blocks per size class
+#define M61_SIZECLASS(sz)	(((sz) + M61_CLASSGRAIN - 1) / M61_CLASSGRAIN)
+#define M61_COUNT(field, delta)	__atomic_store_n(&(field), (field) + (delta), __ATOMIC_RELAXED)
+
+//Per-thread allocation arena. A thread allocates from, and accounts
+//against, its own arena only. Blocks that another thread frees come
+//back through `remoteFree`, a lock-free multi-producer/single-consumer
+//stack that the owner drains on its next allocation. The counters have
+//one writer, the owner, but m61_getstatistics reads them from any
+//thread, so they are only touched through M61_COUNT and relaxed loads.
+typedef struct m61_arena
+{
+  unsigned long long mTotalAlloc_Count;
+  unsigned long long mTotalAlloc_Size;
+  unsigned long long mActive_Count;
+  unsigned long long mActive_Size;
+  unsigned long long mFail_Count;
+  unsigned long long mFail_Size;
+
+  MemAllocHeader* freeList[M61_NCLASSES]; //cached blocks per size class.
+  unsigned freeCount[M61_NCLASSES];
+
+  listNode* head;               //pointer to the head of this arena's List.
+  pthread_mutex_t listLock;     //guards the links of this arena's List.
+  listNode* retiredHead;        //oldest node of a block given back to the system.
+  listNode* retiredTail;
+  unsigned nRetired;
+  listNode* spareNodes;         //recycled nodes, linked through `next`.
+  MemAllocHeader* remoteFree;   //blocks freed by other threads.
+  int inUse;                    //nonzero while a thread owns the arena.
+  struct m61_arena* next;       //next arena in the registry.
+}m61_arena;
+
+//The calling thread's arena, or NULL until its first allocation. Stays
+//NULL in M61_GLOBAL_LOCK builds so the inline path below always misses.
+extern __thread m61_arena* m61_fastArena;
+
+//Nonzero while an allocation limit, failure injection or guard pages are
+//configured; the inline path then defers to m61_malloc.
+extern int m61_debugArmed;
+
+/*m61_pop_free()
+Purpose: hand out a cached block of the right size class, if any.
+Arguments:
+    arena: the calling thread's arena.
+    sz, file, line: as for m61_malloc.
+Return:
+    payload pointer, or NULL if sz is not a small size or the class's free
+    list is empty.
+*/
+static inline void* m61_pop_free(m61_arena* arena, size_t sz, const char* file, int line)
+{
+  if(sz > M61_SMALL_MAX)
+    return NULL;
+  size_t c = M61_SIZECLASS(sz);
+  MemAllocHeader* pHeader = arena->freeList[c];
+  if(pHeader == NULL)
+    return NULL;
+  arena->freeList[c] = pHeader->nextFree;
+  --arena->freeCount[c];
+
+  listNode* node = pHeader->node;
+  //frees from other threads test-and-set the flag atomically
+  __atomic_store_n(&node->IsFree, false, __ATOMIC_RELEASE);
+  node->allocFileName = file;
+  node->allocLineNum = line;
+  pHeader->payLoadSize = sz;
+
+  M61_COUNT(arena->mTotalAlloc_Count, 1);
+  M61_COUNT(arena->mTotalAlloc_Size, sz);
+  M61_COUNT(arena->mActive_Count, 1);
+  M61_COUNT(arena->mActive_Size, sz);
+
+  void* payloadPtr = pHeader + 1;
+  ((MemAllocFooter*)((char*)payloadPtr + sz))->footerValue = (size_t) -1;
+  return payloadPtr;
+}
+
+/*m61_malloc_small()
+Purpose: inline fast path for compile-time-constant small sizes. The size
+class folds to a constant, so a hit is a handful of loads and stores;
+only a miss calls into m61.c.
+*/
+static inline void* m61_malloc_small(size_t sz, const char* file, int line)
+{
+  m61_arena* arena = m61_fastArena;
+  void* ptr;
+  if(__builtin_expect(arena != NULL && !m61_debugArmed, 1)
+     && (ptr = m61_pop_free(arena, sz, file, line)) != NULL)
+    return ptr;
+  return m61_malloc(sz, file, line);
+}
 
 
 #if !M61_DISABLE
-#define malloc(sz)		m61_malloc((sz), __FILE__, __LINE__)
+#define malloc(sz)		(__builtin_constant_p(sz) && (size_t) (sz) <= M61_SMALL_MAX \
+				 ? m61_malloc_small((sz), __FILE__, __LINE__) \
+				 : m61_malloc((sz), __FILE__, __LINE__))
 #define free(ptr)		m61_free((ptr), __FILE__, __LINE__)
 #define realloc(ptr, sz)	m61_realloc((ptr), (sz), __FILE__, __LINE__)
 #define calloc(nmemb, sz)	m61_calloc((nmemb), (sz), __FILE__, __LINE__)
+#define m61_malloc_batch(sz, n, ptrs)	m61_malloc_batch((sz), (n), (ptrs), __FILE__, __LINE__)
+#define m61_free_batch(ptrs, n)		m61_free_batch((ptrs), (n), __FILE__, __LINE__)
 #endif
 
 #endif
@@ -0,0 +1,97 @@
+#include "m61.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+// pctest: producer/consumer throughput for cross-thread frees.
+//
+// Usage: pctest [NTHREADS [COUNT]]
+// NTHREADS/2 producers each malloc COUNT blocks and hand them through a
+// single-producer/single-consumer ring to a paired consumer, which frees
+// them. Every free is therefore a free from a non-owning thread. With one
+// thread, the same thread allocates and frees. Link against m61.o for the
+// lock-free remote-free lists, or m61-locked.o for the mutex baseline.
+
+#define RINGSIZE 256
+
+typedef struct pcpair {
+    void *ring[RINGSIZE];
+    unsigned long long head;	// next slot the producer fills
+    unsigned long long tail;	// next slot the consumer empties
+    unsigned long long count;
+    char pad[64];
+} pcpair;
+
+static size_t sizes[8] = { 8, 16, 24, 32, 48, 64, 128, 256 };
+
+static void *producer(void *arg) {
+    pcpair *p = (pcpair *) arg;
+    for (unsigned long long i = 0; i < p->count; ++i) {
+	while (i - __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) >= RINGSIZE)
+	    sched_yield();
+	void *ptr = malloc(sizes[i % 8]);
+	p->ring[i % RINGSIZE] = ptr;
+	__atomic_store_n(&p->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    pcpair *p = (pcpair *) arg;
+    for (unsigned long long i = 0; i < p->count; ++i) {
+	while (__atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == i)
+	    sched_yield();
+	free(p->ring[i % RINGSIZE]);
+	__atomic_store_n(&p->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int nthreads = 2;
+    unsigned long long count = 20000;
+    if (argc >= 2)
+	nthreads = strtol(argv[1], 0, 0);
+    if (argc >= 3)
+	count = strtoull(argv[2], 0, 0);
+    if (nthreads < 1)
+	nthreads = 1;
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    unsigned long long ops = 0;
+    if (nthreads == 1) {
+	for (unsigned long long i = 0; i < count; ++i) {
+	    void *ptr = malloc(sizes[i % 8]);
+	    free(ptr);
+	}
+	ops = count;
+    } else {
+	int npairs = nthreads / 2;
+	pcpair *pairs = (pcpair *) calloc(npairs, sizeof(pcpair));
+	pthread_t *threads = (pthread_t *) calloc(2 * npairs, sizeof(pthread_t));
+	for (int i = 0; i < npairs; ++i) {
+	    pairs[i].count = count;
+	    pthread_create(&threads[2 * i], NULL, producer, &pairs[i]);
+	    pthread_create(&threads[2 * i + 1], NULL, consumer, &pairs[i]);
+	}
+	for (int i = 0; i < 2 * npairs; ++i)
+	    pthread_join(threads[i], NULL);
+	ops = count * npairs;
+	free(threads);
+	free(pairs);
+    }
+
+    gettimeofday(&end, NULL);
+    double elapsed = (end.tv_sec - start.tv_sec)
+	+ (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    struct m61_statistics stats;
+    m61_getstatistics(&stats);
+    printf("threads %d: %llu malloc/free pairs in %.3fs (%.0f pairs/s), active %llu\n",
+	   nthreads, ops, elapsed, elapsed > 0 ? ops / elapsed : 0.0,
+	   stats.active_count);
+}
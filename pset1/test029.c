@@ -0,0 +1,46 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+// test029: frees from a thread that did not allocate the block.
+
+static void *ptrs[10];
+
+static void *free_all(void *arg) {
+    (void) arg;
+    for (int i = 0; i < 10; ++i)
+	free(ptrs[i]);
+    return NULL;
+}
+
+static void *alloc_all(void *arg) {
+    (void) arg;
+    for (int i = 0; i < 10; ++i)
+	ptrs[i] = malloc(100);
+    return NULL;
+}
+
+int main() {
+    pthread_t t;
+
+    // main thread allocates, another thread frees
+    for (int i = 0; i < 10; ++i)
+	ptrs[i] = malloc(10);
+    pthread_create(&t, NULL, free_all, NULL);
+    pthread_join(t, NULL);
+    void *ptr = malloc(5);
+    m61_printstatistics();
+
+    // an exited thread allocated, main thread frees
+    pthread_create(&t, NULL, alloc_all, NULL);
+    pthread_join(t, NULL);
+    free_all(NULL);
+    free(ptr);
+    m61_printstatistics();
+}
+
+//! malloc count: active          1   total         11   fail          0
+//! malloc size:  active          5   total        105   fail          0
+//! malloc count: active          0   total         21   fail          0
+//! malloc size:  active          0   total       1105   fail          0
@@ -0,0 +1,24 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// test030: reused small blocks report their new size and call site.
+
+int main() {
+    char *a = (char *) malloc(20);
+    free(a);
+    char *b = (char *) malloc(30);
+    size_t n = 25;
+    char *c = (char *) malloc(n);
+    free(c);
+    c = (char *) malloc(n + 3);
+    (void) b;
+    m61_printstatistics();
+    m61_printleakreport();
+}
+
+//!!SORT
+//! LEAK CHECK: test030.c:10: allocated object ??{\w+}?? with size 30
+//! LEAK CHECK: test030.c:14: allocated object ??{\w+}?? with size 28
+//! malloc count: active          2   total          4   fail          0
+//! malloc size:  active         58   total        103   fail          0
@@ -0,0 +1,26 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// test031: batch allocation and free.
+
+int main() {
+    void *ptrs[100];
+    size_t n = m61_malloc_batch(40, 100, ptrs);
+    assert(n == 100);
+    for (int i = 0; i < 100; ++i) {
+	assert(ptrs[i] != NULL);
+	memset(ptrs[i], i, 40);
+    }
+    m61_printstatistics();
+    m61_free_batch(ptrs, 60);
+    m61_printstatistics();
+    m61_free_batch(ptrs + 60, 39);
+    m61_printleakreport();
+}
+
+//! malloc count: active        100   total        100   fail          0
+//! malloc size:  active       4000   total       4000   fail          0
+//! malloc count: active         40   total        100   fail          0
+//! malloc size:  active       1600   total       4000   fail          0
+//! LEAK CHECK: test031.c:9: allocated object ??{\w+}?? with size 40
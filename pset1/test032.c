@@ -0,0 +1,25 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// test032: allocations past the active-bytes limit fail.
+
+int main() {
+    char *keep = (char *) malloc(100);
+    m61_setlimit(1000);
+    char *a = (char *) malloc(600);
+    char *b = (char *) malloc(400);
+    assert(a != NULL && b == NULL);
+    char *c = (char *) realloc(a, 950);
+    assert(c == NULL);
+    free(a);
+    b = (char *) malloc(400);
+    assert(b != NULL);
+    free(b);
+    free(keep);
+    m61_setlimit(0);
+    m61_printstatistics();
+}
+
+//! malloc count: active          0   total          3   fail          2
+//! malloc size:  active          0   total       1100   fail       1350
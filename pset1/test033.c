@@ -0,0 +1,19 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// test033: failure injection at a call site named in M61_FAIL.
+
+int main() {
+    setenv("M61_FAIL", "site=test033.c:11", 1);
+    for (int i = 0; i < 5; ++i) {
+	void *a = malloc(10);
+	void *b = malloc(20);
+	assert(a != NULL && b == NULL);
+	free(a);
+    }
+    m61_printstatistics();
+}
+
+//! malloc count: active          0   total          5   fail          5
+//! malloc size:  active          0   total         50   fail        100
@@ -0,0 +1,20 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+// test034: guard-page mode catches an overflow at the faulting write.
+
+int main() {
+    setenv("M61_GUARD", "min=4096", 1);
+    char *a = (char *) malloc(8192);
+    memset(a, 'A', 8192);
+    free(a);
+    char *b = (char *) malloc(5000);
+    memset(b, 'B', 5000);
+    b[5000 + 16] = 'X';
+}
+
+//! MEMORY BUG: wild access at ??{0x\w+}??, 16 bytes past the end of pointer ??{0x\w+}=ptr??
+//!   test034.c:13: ??ptr?? is a 5000 byte region allocated here
+//! ???
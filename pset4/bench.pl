@@ -0,0 +1,253 @@
+#! /usr/bin/perl
+# bench.pl -- repeatable timings of the io61, stdio and slow builds
+#
+# Usage: perl bench.pl [-n RUNS] [-b BUILDS] [-g BIGSIZE] [-o FILE] [WORKLOAD...]
+#    Runs each workload (all of them, or those named) RUNS times (default
+#    5) with each build in BUILDS (default "stdio,io61,slow") and prints a
+#    CSV row per workload and build: median and 95th-percentile wall
+#    time, and per-run medians of user and system CPU time, read/write
+#    system calls, and minor and major page faults, plus the throughput
+#    at the median time. The first build that finishes a workload is the
+#    reference, and later builds whose files/out.txt differs from it are
+#    marked "differs". A run that takes too long is killed and the rest of
+#    that build's runs are skipped.
+#
+#    No strace or perf is needed: CPU time and page faults are deltas of
+#    the reaped children's totals (times and /proc/self/stat), and system
+#    calls are deltas of syscr + syscw in /proc/self/io, which counts the
+#    read- and write-family calls (read, pread, readv, write, sendfile,
+#    copy_file_range...) of reaped children. Data read through mmap costs
+#    page faults instead of system calls.
+#
+#    The GB-scale workloads read files/big.txt, BIGSIZE bytes (default
+#    1 GB). The slow build reads it a byte per system call and is
+#    normally killed there; leave it out with -b stdio,io61.
+
+use Time::HiRes;
+use POSIX qw(ceil);
+
+my($nruns) = 5;
+my(@builds) = ("stdio", "io61", "slow");
+my($bigsize) = 1 << 30;
+my($outfile);
+while (@ARGV && $ARGV[0] =~ /^-/) {
+    my($opt) = shift @ARGV;
+    die "bench.pl: $opt needs an argument\n" if !@ARGV;
+    if ($opt eq "-n") {
+	$nruns = shift @ARGV;
+    } elsif ($opt eq "-b") {
+	@builds = split(/,/, shift @ARGV);
+    } elsif ($opt eq "-g") {
+	$bigsize = shift @ARGV;
+    } elsif ($opt eq "-o") {
+	$outfile = shift @ARGV;
+    } else {
+	die "Usage: perl bench.pl [-n RUNS] [-b BUILDS] [-g BIGSIZE] [-o FILE] [WORKLOAD...]\n";
+    }
+}
+my(%prefix) = ("io61" => "", "stdio" => "stdio-", "slow" => "slow-");
+foreach my $b (@builds) {
+    die "bench.pl: unknown build $b\n" if !exists($prefix{$b});
+}
+
+# name, input (for throughput), command, seconds before a run is killed
+my(@workloads) = (
+    ["seq-regular-1m", "files/text1meg.txt",
+     "./cat61 files/text1meg.txt > files/out.txt", 10],
+    ["seq-regular-20m", "files/text20meg.txt",
+     "./cat61 files/text20meg.txt > files/out.txt", 20],
+    ["seq-piped-20m", "files/text20meg.txt",
+     "cat files/text20meg.txt | ./cat61 | cat > files/out.txt", 20],
+    ["char-regular-20m", "files/text20meg.txt",
+     "./charcat61 files/text20meg.txt > files/out.txt", 20],
+    ["block-1k-20m", "files/text20meg.txt",
+     "./blockcat61 -b 1024 files/text20meg.txt > files/out.txt", 20],
+    ["seq-regular-big", "files/big.txt",
+     "./cat61 files/big.txt > files/out.txt", 120],
+    ["block-64k-big", "files/big.txt",
+     "./blockcat61 -b 65536 files/big.txt > files/out.txt", 120],
+    ["tiny-files", "files/tiny",
+     "for f in files/tiny/*; do ./cat61 \$f; done > files/out.txt", 30],
+    ["random-1b-5m", "files/text5meg.txt",
+     "./randomcat61 -b 1 files/text5meg.txt > files/out.txt", 30],
+    ["reverse-1b-5m", "files/text5meg.txt",
+     "./reverse61 files/text5meg.txt > files/out.txt", 30],
+    ["mixed-reorder-20m", "files/text20meg.txt",
+     "./reordercat61 files/text20meg.txt > files/out.txt", 30],
+    ["mixed-ostride-5m", "files/text5meg.txt",
+     "./ostridecat61 -s 1048576 files/text5meg.txt > files/out.txt", 30],
+    ["mixed-exchange", undef,
+     "./pipeexchange61 > /dev/null", 30]
+);
+if (@ARGV) {
+    my(%want) = map { $_ => 1 } @ARGV;
+    foreach my $w (@ARGV) {
+	die "bench.pl: unknown workload $w\n" if !grep { $_->[0] eq $w } @workloads;
+    }
+    @workloads = grep { $want{$_->[0]} } @workloads;
+}
+
+sub makefile ($$;$) {
+    my($filename, $size, $source) = @_;
+    $source = "/usr/share/dict/words" if !$source;
+    if (!-r $filename || -s $filename != $size) {
+	truncate($filename, 0);
+	while (-s $filename < $size) {
+	    system("cat $source >> $filename");
+	}
+	truncate($filename, $size);
+    }
+}
+
+sub maketiny ($$) {
+    my($dir, $n) = @_;
+    mkdir $dir if !-d $dir;
+    return if -r sprintf("%s/%04d", $dir, $n - 1);
+    open(my $words, "<", "files/text1meg.txt") or die "files/text1meg.txt: $!\n";
+    local $/;
+    my($text) = <$words>;
+    srand(61);
+    for (my $i = 0; $i < $n; ++$i) {
+	open(my $fh, ">", sprintf("%s/%04d", $dir, $i)) or die "$dir: $!\n";
+	my($len) = 1 + int(rand(4096));
+	print $fh substr($text, int(rand(length($text) - $len)), $len);
+	close($fh);
+    }
+}
+
+sub input_bytes ($) {
+    my($input) = @_;
+    return 0 if !defined($input);
+    return -s $input if !-d $input;
+    my($total) = 0;
+    $total += -s $_ foreach glob("$input/*");
+    return $total;
+}
+
+# counters() -- the reaped children's totals so far
+sub counters () {
+    my(%c);
+    my($user, $sys, $cuser, $csys) = times();
+    $c{user} = $cuser;
+    $c{sys} = $csys;
+    open(my $io, "<", "/proc/self/io") or die "/proc/self/io: $!\n";
+    while (<$io>) {
+	$c{syscalls} += $1 if /^sysc[rw]: (\d+)/;
+    }
+    close($io);
+    open(my $stat, "<", "/proc/self/stat") or die "/proc/self/stat: $!\n";
+    my($line) = <$stat>;
+    close($stat);
+    # fields after the parenthesized command name, which may hold spaces
+    my(@f) = split(/ /, substr($line, rindex($line, ")") + 2));
+    $c{minflt} = $f[7];                # cminflt
+    $c{majflt} = $f[9];                # cmajflt
+    return \%c;
+}
+
+sub run_once ($$) {
+    my($command, $max_time) = @_;
+    my($before) = Time::HiRes::time();
+    my($pid) = fork();
+    if ($pid == 0) {
+	setpgrp(0, 0);
+	exec("/bin/sh", "-c", $command) or exit(127);
+    }
+    my($killed) = 0;
+    eval {
+	local $SIG{"ALRM"} = sub { die "timeout\n" };
+	alarm $max_time;
+	waitpid($pid, 0);
+	alarm 0;
+    };
+    if ($@) {
+	kill 9, -$pid;
+	waitpid($pid, 0);
+	$killed = 1;
+    }
+    return ($killed, Time::HiRes::time() - $before);
+}
+
+sub median (@) {
+    my(@x) = sort { $a <=> $b } @_;
+    return @x % 2 ? $x[$#x / 2] : ($x[@x / 2 - 1] + $x[@x / 2]) / 2;
+}
+
+sub percentile ($@) {
+    my($p, @x) = @_;
+    @x = sort { $a <=> $b } @x;
+    return $x[ceil($p / 100 * @x) - 1];
+}
+
+# create the input files
+mkdir "files" if !-d "files";
+makefile("files/text1meg.txt", 1 << 20);
+makefile("files/text5meg.txt", 5 << 20);
+makefile("files/text20meg.txt", 20 << 20);
+makefile("files/big.txt", $bigsize, "files/text20meg.txt")
+    if grep { defined($_->[1]) && $_->[1] eq "files/big.txt" } @workloads;
+maketiny("files/tiny", 200);
+
+my($out) = \*STDOUT;
+if ($outfile) {
+    open($out, ">", $outfile) or die "$outfile: $!\n";
+}
+$| = 1;
+print $out "workload,build,runs,bytes,median_s,p95_s,user_s,sys_s,syscalls,minflt,majflt,mb_per_s,status\n";
+
+# counters() itself reads /proc, so subtract what one call costs
+my($c0) = counters();
+my($c1) = counters();
+my($selfcalls) = $c1->{syscalls} - $c0->{syscalls};
+
+foreach my $w (@workloads) {
+    my($name, $input, $command, $max_time) = @$w;
+    my($bytes) = input_bytes($input);
+    my($refsum);
+    foreach my $build (@builds) {
+	my($cmd) = $command;
+	my($p) = $prefix{$build};
+	$cmd =~ s<(\./)([a-z]*61)><$1$p$2>g;
+	my(@progs) = ($cmd =~ m<\./([-a-z0-9]+)>g);
+	if (grep { !-x $_ } @progs) {
+	    print $out "$name,$build,0,$bytes,,,,,,,,,missing\n";
+	    next;
+	}
+
+	my(%m) = map { $_ => [] } qw(wall user sys syscalls minflt majflt);
+	my($status) = "ok";
+	for (my $i = 1; $i <= $nruns; ++$i) {
+	    my($before) = counters();
+	    my($killed, $wall) = run_once($cmd, $max_time);
+	    my($after) = counters();
+	    if ($killed) {
+		$status = "killed";
+		printf STDERR "bench: %s %s run %d/%d KILLED after %gs\n",
+		    $name, $build, $i, $nruns, $max_time;
+		last;
+	    }
+	    push @{$m{wall}}, $wall;
+	    push @{$m{$_}}, $after->{$_} - $before->{$_}
+		foreach qw(user sys minflt majflt);
+	    push @{$m{syscalls}}, $after->{syscalls} - $before->{syscalls} - $selfcalls;
+	    printf STDERR "bench: %s %s run %d/%d %.3fs\n", $name, $build, $i, $nruns, $wall;
+	}
+
+	my($runs) = scalar(@{$m{wall}});
+	if ($status eq "ok" && $command =~ m<files/out\.txt>) {
+	    my($sum) = (split(/ /, `md5sum files/out.txt`))[0];
+	    $refsum = $sum if !defined($refsum);
+	    $status = "differs" if $sum ne $refsum;
+	}
+	if ($runs == 0) {
+	    print $out "$name,$build,0,$bytes,,,,,,,,,$status\n";
+	    next;
+	}
+	my($med) = median(@{$m{wall}});
+	printf $out "%s,%s,%d,%d,%.6f,%.6f,%.3f,%.3f,%d,%d,%d,%s,%s\n",
+	    $name, $build, $runs, $bytes, $med, percentile(95, @{$m{wall}}),
+	    median(@{$m{user}}), median(@{$m{sys}}), median(@{$m{syscalls}}),
+	    median(@{$m{minflt}}), median(@{$m{majflt}}),
+	    $bytes ? sprintf("%.1f", $bytes / $med / 1e6) : "", $status;
+    }
+}
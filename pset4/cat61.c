@@ -1,15 +1,40 @@
 #include "io61.h"
+#include <limits.h>
+#include <errno.h>
 
 int main(int argc, char **argv) {
+    // -z compresses the output, -d reads compressed input; -c writes
+    // checksummed blocks, -v reads and verifies them
+    int inmode = O_RDONLY, outmode = O_WRONLY;
+    if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
+        outmode |= IO61_COMPRESS;
+        --argc, ++argv;
+    } else if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
+        inmode |= IO61_COMPRESS;
+        --argc, ++argv;
+    } else if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+        outmode |= IO61_CHECKSUM;
+        --argc, ++argv;
+    } else if (argc >= 2 && strcmp(argv[1], "-v") == 0) {
+        inmode |= IO61_CHECKSUM;
+        --argc, ++argv;
+    }
+
     const char *in_filename = argc >= 2 ? argv[1] : NULL;
-    io61_file *inf = io61_open_check(in_filename, O_RDONLY);
-    io61_file *outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+    io61_file *inf = io61_open_check(in_filename, inmode);
+    io61_file *outf = io61_fdopen(STDOUT_FILENO, outmode);
 
-    while (1) {
-        int ch = io61_readc(inf);
-        if (ch == EOF)
-            break;
-        io61_writec(outf, ch);
+    // io61_copy stops short at an error after some data, so go on
+    // until it reports end of file or the error (the slow version's
+    // reads return -1 at end of file, without setting errno)
+    ssize_t r;
+    do {
+        errno = 0;
+        r = io61_copy(inf, outf, SSIZE_MAX);
+    } while (r > 0);
+    if (r < 0 && errno != 0) {
+        perror("cat61");
+        exit(1);
     }
 
     io61_close(inf);
@@ -1,7 +1,9 @@
 #! /usr/bin/perl
 use Time::HiRes qw(gettimeofday);
+use Socket;
 my($nkilled) = 0;
 my($nerror) = 0;
+my($nchecks) = 0;
 my(@ratios);
 my(@times);
 
@@ -37,13 +39,18 @@ sub run_time ($;$) {
     return $delta <= 0 ? 0.000001 : $delta;
 }
 
-sub run ($$$$;$) {
-    my($number, $infile, $command, $desc, $max_time) = @_;
-    return if (@ARGV && !grep {
+sub selected ($) {
+    my($number) = @_;
+    return !@ARGV || grep {
 	$_ == $number
 	    || ($_ =~ m{^(\d+)-(\d+)$} && $number >= $1 && $number <= $2)
 	    || ($_ =~ m{(?:^|,)$number(,|$)})
-	       } @ARGV);
+	       } @ARGV;
+}
+
+sub run ($$$$;$) {
+    my($number, $infile, $command, $desc, $max_time) = @_;
+    return if !selected($number);
     $max_time = 30 if !$max_time;
     my($base) = $command;
     my($crap) = `md5sum $infile`;
@@ -70,17 +77,78 @@ sub run ($$$$;$) {
     print "\n";
 }
 
+# check(number, command, desc)
+#    Correctness test: `command`, a shell command or a sub, must succeed.
+sub check ($$$) {
+    my($number, $command, $desc) = @_;
+    return if !selected($number);
+    print "TEST:      $number. $desc\n";
+    my($ok);
+    if (ref($command) eq "CODE") {
+	$ok = $command->();
+    } else {
+	print "COMMAND:   $command\n";
+	$ok = system("sh", "-c", $command) == 0;
+    }
+    print $ok ? "RESULT:    OK\n\n" : "           ERROR! unexpected result\n\n";
+    ++$nchecks;
+    ++$nerror if !$ok;
+}
+
+# socket_cat(infile, from_socket)
+#    Run cat61 with a socket on one side: from `infile` to a socket if
+#    `from_socket` is false, else from a socket to files/out.txt. Returns
+#    true if cat61 succeeds and files/out.txt matches `infile`.
+sub socket_cat ($$) {
+    my($infile, $from_socket) = @_;
+    local $SIG{"PIPE"} = "IGNORE";
+    socketpair(my $ours, my $theirs, AF_UNIX, SOCK_STREAM, PF_UNSPEC) or die;
+    my($pid) = fork();
+    if ($pid == 0) {
+	close($ours);
+	if ($from_socket) {
+	    open(STDIN, "<&", $theirs) or die;
+	    open(STDOUT, ">", "files/out.txt") or die;
+	    exec("./cat61");
+	} else {
+	    open(STDOUT, ">&", $theirs) or die;
+	    exec("./cat61", $infile);
+	}
+	exit(1);
+    }
+    close($theirs);
+    my($buf);
+    if ($from_socket) {
+	open(IN, "<", $infile) or die;
+	while (sysread(IN, $buf, 65536)) {
+	    print $ours $buf;
+	}
+	close(IN);
+	shutdown($ours, 1);
+    } else {
+	open(OUT, ">", "files/out.txt") or die;
+	while (sysread($ours, $buf, 65536)) {
+	    print OUT $buf;
+	}
+	close(OUT);
+    }
+    close($ours);
+    waitpid($pid, 0);
+    return $? == 0 && system("cmp", "-s", $infile, "files/out.txt") == 0;
+}
+
 sub pl ($$) {
     my($n, $x) = @_;
     return $n . " " . ($n == 1 ? $x : $x . "s");
 }
 
 sub summary () {
-    my($ntests) = @ratios + $nkilled;
+    my($ntests) = @ratios + $nkilled + $nchecks;
     print "SUMMARY:   ", pl($ntests, "test"),
 	", $nkilled killed, ", pl($nerror, "error"), "\n";
     my($better) = scalar(grep { $_ > 1 } @ratios);
     my($worse) = scalar(grep { $_ < 1 } @ratios);
+    return if !@ratios;
     print "           better than stdio ", pl($better, "time"),
     ", worse ", pl($worse, "time"), "\n";
     my($mean, $time, $yourtime) = (0, 0, 0);
@@ -106,27 +174,27 @@ $SIG{"INT"} = sub {
 };
 
 run(1, "files/text1meg.txt",
-    "./cat61 files/text1meg.txt > files/out.txt",
+    "./charcat61 files/text1meg.txt > files/out.txt",
     "sequential regular small file 1B", 10);
 
 run(2, "files/text1meg.txt",
-    "cat files/text1meg.txt | ./cat61 | cat > files/out.txt",
+    "cat files/text1meg.txt | ./charcat61 | cat > files/out.txt",
     "sequential piped small file 1B", 10);
 
 run(3, "files/text5meg.txt",
-    "./cat61 files/text5meg.txt > files/out.txt",
+    "./charcat61 files/text5meg.txt > files/out.txt",
     "sequential regular medium file 1B", 10);
 
 run(4, "files/text5meg.txt",
-    "cat files/text5meg.txt | ./cat61 | cat > files/out.txt",
+    "cat files/text5meg.txt | ./charcat61 | cat > files/out.txt",
     "sequential piped medium file 1B", 10);
 
 run(5, "files/text20meg.txt",
-    "./cat61 files/text20meg.txt > files/out.txt",
+    "./charcat61 files/text20meg.txt > files/out.txt",
     "sequential regular large file 1B", 20);
 
 run(6, "files/text20meg.txt",
-    "cat files/text20meg.txt | ./cat61 | cat > files/out.txt",
+    "cat files/text20meg.txt | ./charcat61 | cat > files/out.txt",
     "sequential piped large file 1B", 20);
 
 run(7, "files/text5meg.txt",
@@ -185,4 +253,36 @@ run(20, "files/text5meg.txt",
     "./stridecat61 -s 1048576 files/text5meg.txt > files/out.txt",
     "1MB stride medium file", 20);
 
+# correctness of io61_copy's kernel paths and the stream formats
+check(21, "./cat61 files/text5meg.txt > files/out.txt && cmp files/text5meg.txt files/out.txt",
+      "copy regular file to regular file");
+
+check(22, "./cat61 files/text5meg.txt | cat > files/out.txt && cmp files/text5meg.txt files/out.txt",
+      "copy regular file to pipe");
+
+check(23, "cat files/text5meg.txt | ./cat61 > files/out.txt && cmp files/text5meg.txt files/out.txt",
+      "copy pipe to regular file");
+
+check(24, "./cat61 < files/text5meg.txt > files/out.txt && cmp files/text5meg.txt files/out.txt",
+      "copy standard input to regular file");
+
+check(25, sub { socket_cat("files/text5meg.txt", 0) },
+      "copy regular file to socket");
+
+check(26, sub { socket_cat("files/text5meg.txt", 1) },
+      "copy socket to regular file");
+
+check(27, "./cat61 -z files/text5meg.txt | ./cat61 -d > files/out.txt && cmp files/text5meg.txt files/out.txt",
+      "compressed round trip");
+
+check(28, "./cat61 -c files/text5meg.txt | ./cat61 -v > files/out.txt && cmp files/text5meg.txt files/out.txt",
+      "checksummed round trip");
+
+check(29, "./cat61 -c files/text5meg.txt > files/out.ck"
+      . " && perl -e 'open(F, \"+<\", \"files/out.ck\") or die; seek(F, 200000, 0); read(F, \$c, 1);"
+      . " seek(F, 200000, 0); print F chr(ord(\$c) ^ 1)'"
+      . " && ! ./cat61 -v files/out.ck 2>files/err.txt >/dev/null"
+      . " && grep -q 'Input/output error' files/err.txt",
+      "checksummed file with a flipped byte fails with EIO");
+
 summary();